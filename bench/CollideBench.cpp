@@ -0,0 +1,464 @@
+//
+// Headless scaling benchmark: steps N strips of Collide modules the way the engine does,
+// and reads the hardware counters through perf_event_open.
+//
+// usage: CollideBench [-n strips] [-s samples] [-r sample rate] [-l mixed|grouped|shuffled] [-d]
+//
+// -d compares the layouts of the RC diode state for one 16 channel poly cable instead
+//
+// The bench is built twice: CollideBench with the module state as shipped, and
+// CollideBench-compact with COLLIDE_COMPACT_STATE, where CollidePan shares its index tables
+// between the instances and CollideFollow keeps both followers in one float_4 diode.
+// make compare ARGS="..." runs both with the same options.
+//
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "plugin.hpp"
+#include "ColliderUtils.h"
+
+
+void init(Plugin *p);
+
+/*! A strip is one voice of a typical patch
+    Shuf gate 1 -> Env gate, Env signal -> Pan signal 1, Env env -> Follow 1 -> Pan mod 1
+ */
+enum StripModules {
+    STRIP_SHUF,
+    STRIP_ENV,
+    STRIP_FOLLOW,
+    STRIP_PAN,
+    NUM_STRIP_MODULES
+};
+
+// port and param indices of the modules, see the enums in src/
+const int SHUF_INPUT_GATE = 8;
+const int SHUF_OUTPUT_GATE_1 = 0;
+const int ENV_INPUT_SIGNAL = 0;
+const int ENV_INPUT_GATE_TRIG = 1;
+const int ENV_OUTPUT_ENV = 4;
+const int ENV_OUTPUT_SIGNAL = 5;
+const int FOLLOW_INPUT_SIGNAL_1 = 0;
+const int FOLLOW_OUTPUT_SIGNAL_1 = 0;
+const int PAN_PARAM_ATV_1 = 1;
+const int PAN_INPUT_SIGNAL_1 = 0;
+const int PAN_INPUT_MOD_1 = 1;
+const int PAN_OUTPUT_SIGNAL_L_1 = 0;
+const int PAN_OUTPUT_SIGNAL_R_1 = 1;
+
+enum Layouts {
+    LAYOUT_MIXED,    // allocated and stepped strip by strip, like a patch built voice by voice
+    LAYOUT_GROUPED,  // allocated and stepped module type by module type
+    LAYOUT_SHUFFLED, // allocated strip by strip, stepped in a random order
+};
+
+struct BenchCable {
+    Module *outputModule;
+    int outputId;
+    Module *inputModule;
+    int inputId;
+
+    BenchCable(Module *outputModule, int outputId, Module *inputModule, int inputId):
+    outputModule(outputModule), outputId(outputId), inputModule(inputModule), inputId(inputId)
+    {
+        // the engine makes an unconnected output monophonic when a cable is added
+        if (outputModule->outputs[outputId].getChannels() == 0)
+            outputModule->outputs[outputId].setChannels(1);
+    }
+
+    /*! Copy the output voltages to the input, as engine::Cable::step() does
+     */
+    void step() {
+        engine::Output &output = outputModule->outputs[outputId];
+        engine::Input &input = inputModule->inputs[inputId];
+        int channels = output.getChannels();
+        input.setChannels(channels);
+        for (int c = 0; c < channels; ++c)
+            input.setVoltage(output.getVoltage(c), c);
+    }
+};
+
+/*! A group of hardware counters, scheduled and read together
+    The cycles counter leads the group, so all the counts cover the same time slices.
+ */
+struct PerfCounters {
+    enum CounterIds {
+        COUNTER_CYCLES,
+        COUNTER_INSTRUCTIONS,
+        COUNTER_L1D_MISSES,
+        COUNTER_LLC_MISSES,
+        NUM_COUNTERS
+    };
+
+    int fds[NUM_COUNTERS];
+    long long values[NUM_COUNTERS];
+    bool multiplexed = false;
+
+    PerfCounters() {
+        const uint32_t types[NUM_COUNTERS] = {
+            PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HW_CACHE
+        };
+        const uint64_t configs[NUM_COUNTERS] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+        };
+
+        for (int i = 0; i < NUM_COUNTERS; ++i) {
+            values[i] = -1;
+            fds[i] = -1;
+            // without the leader there is no group
+            if (i > 0 && fds[0] < 0)
+                continue;
+
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = types[i];
+            attr.config = configs[i];
+            attr.disabled = i == 0; // the members follow the leader
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            fds[i] = syscall(__NR_perf_event_open, &attr, 0, -1, i == 0 ? -1 : fds[0], 0);
+        }
+    }
+
+    ~PerfCounters() {
+        for (int i = 0; i < NUM_COUNTERS; ++i) {
+            if (fds[i] >= 0)
+                close(fds[i]);
+        }
+    }
+
+    void start() {
+        if (fds[0] >= 0) {
+            ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+            ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+    }
+
+    /*! Stop the group and read the counts
+        If the group was multiplexed, the counts are scaled to the whole enabled time.
+     */
+    void stop() {
+        if (fds[0] < 0)
+            return;
+        ioctl(fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+        // {nr, time enabled, time running, values in the order they joined the group}
+        uint64_t data[3 + NUM_COUNTERS];
+        ssize_t size = ::read(fds[0], data, sizeof(data));
+        if (size < (ssize_t) (3 * sizeof(uint64_t)))
+            return;
+        uint64_t nr = data[0];
+        uint64_t enabled = data[1];
+        uint64_t running = data[2];
+        if (running == 0)
+            return;
+        multiplexed = running < enabled;
+        double scale = (double) enabled / running;
+
+        uint64_t slot = 0;
+        for (int i = 0; i < NUM_COUNTERS && slot < nr; ++i) {
+            if (fds[i] >= 0)
+                values[i] = (long long) (data[3 + slot++] * scale);
+        }
+    }
+
+    /*! Return the counter value, or -1 if the counter is not available
+     */
+    long long read(int id) {
+        return values[id];
+    }
+};
+
+void printPerSample(const char *name, long long value, long long samples) {
+    if (value < 0)
+        std::printf("%-16s %12s\n", name, "n/a");
+    else
+        std::printf("%-16s %12.2f\n", name, (double) value / samples);
+}
+
+/*! Return the size of the heap chunk at p, 0 for nullptr
+ */
+size_t heapSize(const void *p) {
+    return p ? malloc_usable_size(const_cast<void*>(p)) : 0;
+}
+
+/*! Return the heap size of the params, inputs, outputs and lights of a module
+ */
+size_t vectorsSize(Module *module) {
+    return heapSize(module->params.data()) + heapSize(module->inputs.data())
+        + heapSize(module->outputs.data()) + heapSize(module->lights.data());
+}
+
+int usage(const char *name) {
+    std::fprintf(stderr, "usage: %s [-n strips] [-s samples] [-r sample rate] [-l mixed|grouped|shuffled] [-d]\n", name);
+    return 1;
+}
+
+/*! Follow 16 channels with RC diodes, with the state in 3 layouts:
+    one RCDiode<float> per channel, one RCDiode<float_4> per 4 channels with blocks, and one RCDiodeBank.
+    Then smooth them with RC filters, one RCFilter<float> per channel or one RCFilter<float_4> with blocks.
+ */
+int benchDiodes(long long numSamples) {
+    const int CHANNELS = 16;
+    const int GROUPS = CHANNELS / 4;
+    const int BLOCK = 32;
+    const int NUM_BLOCKS = 64; // the input repeats after NUM_BLOCKS blocks
+    const float TAU = 0.01f;
+    long long numIterations = std::max(numSamples / BLOCK, 1LL);
+
+    // interleaved frames, as on a poly cable
+    std::vector<float> input(NUM_BLOCKS * BLOCK * CHANNELS);
+    std::mt19937 rng(2);
+    for (float &x : input)
+        x = 10.f * std::uniform_real_distribution<float>()(rng);
+
+    std::vector<float> scalarOut(BLOCK * CHANNELS), blockOut(BLOCK * CHANNELS), bankOut(BLOCK * CHANNELS);
+    std::vector<RCDiode<float>> scalar(CHANNELS, RCDiode<float>(TAU));
+    std::vector<RCDiode<simd::float_4>> block(GROUPS, RCDiode<simd::float_4>(TAU));
+    RCDiodeBank<GROUPS> bank(TAU);
+    simd::float_4 groupIn[GROUPS][BLOCK], groupOut[GROUPS][BLOCK];
+    std::vector<RCFilter<float>> scalarFilters(CHANNELS, RCFilter<float>(TAU));
+    std::vector<RCFilter<simd::float_4>> blockFilters(GROUPS, RCFilter<simd::float_4>(TAU));
+    std::vector<float> scalarSmooth(BLOCK * CHANNELS);
+    simd::float_4 groupSmooth[GROUPS][BLOCK];
+
+    double seconds[5] = {0, 0, 0, 0, 0};
+    float maxDiff = 0.f;
+    for (long long it = 0; it < numIterations; ++it) {
+        const float *x = &input[(it % NUM_BLOCKS) * BLOCK * CHANNELS];
+
+        auto t0 = std::chrono::steady_clock::now();
+        for (int i = 0; i < BLOCK; ++i) {
+            for (int c = 0; c < CHANNELS; ++c)
+                scalarOut[i * CHANNELS + c] = scalar[c].chargeOrDecay(x[i * CHANNELS + c]);
+        }
+
+        // the block API wants the frames of one group together
+        auto t1 = std::chrono::steady_clock::now();
+        for (int i = 0; i < BLOCK; ++i) {
+            for (int g = 0; g < GROUPS; ++g)
+                groupIn[g][i] = simd::float_4::load(&x[i * CHANNELS + g * 4]);
+        }
+        for (int g = 0; g < GROUPS; ++g)
+            block[g].chargeOrDecayBlock(groupIn[g], groupOut[g], BLOCK);
+        for (int i = 0; i < BLOCK; ++i) {
+            for (int g = 0; g < GROUPS; ++g)
+                groupOut[g][i].store(&blockOut[i * CHANNELS + g * 4]);
+        }
+
+        auto t2 = std::chrono::steady_clock::now();
+        bank.chargeOrDecayBlock(x, bankOut.data(), BLOCK);
+        auto t3 = std::chrono::steady_clock::now();
+        for (int i = 0; i < BLOCK; ++i) {
+            for (int c = 0; c < CHANNELS; ++c)
+                scalarSmooth[i * CHANNELS + c] = scalarFilters[c].process(scalarOut[i * CHANNELS + c]);
+        }
+
+        auto t4 = std::chrono::steady_clock::now();
+        for (int g = 0; g < GROUPS; ++g)
+            blockFilters[g].processBlock(groupOut[g], groupSmooth[g], BLOCK);
+        auto t5 = std::chrono::steady_clock::now();
+
+        seconds[0] += std::chrono::duration<double>(t1 - t0).count();
+        seconds[1] += std::chrono::duration<double>(t2 - t1).count();
+        seconds[2] += std::chrono::duration<double>(t3 - t2).count();
+        seconds[3] += std::chrono::duration<double>(t4 - t3).count();
+        seconds[4] += std::chrono::duration<double>(t5 - t4).count();
+        for (int k = 0; k < BLOCK * CHANNELS; ++k) {
+            maxDiff = std::max(maxDiff, std::abs(blockOut[k] - scalarOut[k]));
+            maxDiff = std::max(maxDiff, std::abs(bankOut[k] - scalarOut[k]));
+        }
+        for (int i = 0; i < BLOCK; ++i) {
+            for (int c = 0; c < CHANNELS; ++c)
+                maxDiff = std::max(maxDiff, std::abs(groupSmooth[c / 4][i][c % 4] - scalarSmooth[i * CHANNELS + c]));
+        }
+    }
+
+    long long samples = numIterations * BLOCK;
+    std::printf("channels         %12d\n", CHANNELS);
+    std::printf("samples          %12lld\n", samples);
+#if defined(__AVX__)
+    std::printf("bank path        %12s\n", "AVX");
+#else
+    std::printf("bank path        %12s\n", "float_4");
+#endif
+    std::printf("scalar ns/sample %12.2f\n", seconds[0] * 1e9 / samples);
+    std::printf("block ns/sample  %12.2f\n", seconds[1] * 1e9 / samples);
+    std::printf("bank ns/sample   %12.2f\n", seconds[2] * 1e9 / samples);
+    std::printf("scalar RC ns/sample %9.2f\n", seconds[3] * 1e9 / samples);
+    std::printf("block RC ns/sample  %9.2f\n", seconds[4] * 1e9 / samples);
+    std::printf("max difference   %12g\n", maxDiff);
+    return maxDiff == 0.f ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+    int numStrips = 128;
+    long long numSamples = 48000 * 10;
+    float sampleRate = 48000.f;
+    Layouts layout = LAYOUT_MIXED;
+    bool diodes = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "n:s:r:l:d")) != -1) {
+        switch (c) {
+            case 'd': diodes = true; break;
+            case 'n': numStrips = std::atoi(optarg); break;
+            case 's': numSamples = std::atoll(optarg); break;
+            case 'r': sampleRate = std::atof(optarg); break;
+            case 'l':
+                if (!std::strcmp(optarg, "grouped"))
+                    layout = LAYOUT_GROUPED;
+                else if (!std::strcmp(optarg, "shuffled"))
+                    layout = LAYOUT_SHUFFLED;
+                else if (!std::strcmp(optarg, "mixed"))
+                    layout = LAYOUT_MIXED;
+                else
+                    return usage(argv[0]);
+                break;
+            default:
+                return usage(argv[0]);
+        }
+    }
+    if (numStrips <= 0 || numSamples <= 0 || !(sampleRate > 0.f))
+        return usage(argv[0]);
+
+    // a headless context, only the engine is needed by the modules
+    random::init();
+    contextSet(new Context);
+    APP->engine = new engine::Engine;
+    APP->engine->setSampleRate(sampleRate);
+    init(new Plugin);
+
+    if (diodes)
+        return benchDiodes(numSamples);
+
+    Model *models[NUM_STRIP_MODULES] = {modelCollideShuf, modelCollideEnv, modelCollideFollow, modelCollidePan};
+    std::vector<std::vector<Module*>> strips(numStrips, std::vector<Module*>(NUM_STRIP_MODULES));
+    if (layout == LAYOUT_GROUPED) {
+        for (int m = 0; m < NUM_STRIP_MODULES; ++m) {
+            for (int i = 0; i < numStrips; ++i)
+                strips[i][m] = models[m]->createModule();
+        }
+    } else {
+        for (int i = 0; i < numStrips; ++i) {
+            for (int m = 0; m < NUM_STRIP_MODULES; ++m)
+                strips[i][m] = models[m]->createModule();
+        }
+    }
+
+    // the step order follows the allocation order, except for the shuffled layout
+    std::vector<Module*> modules;
+    if (layout == LAYOUT_GROUPED) {
+        for (int m = 0; m < NUM_STRIP_MODULES; ++m) {
+            for (int i = 0; i < numStrips; ++i)
+                modules.push_back(strips[i][m]);
+        }
+    } else {
+        for (int i = 0; i < numStrips; ++i)
+            modules.insert(modules.end(), strips[i].begin(), strips[i].end());
+    }
+    if (layout == LAYOUT_SHUFFLED)
+        std::shuffle(modules.begin(), modules.end(), std::mt19937(0));
+
+    std::vector<BenchCable> cables;
+    for (int i = 0; i < numStrips; ++i) {
+        std::vector<Module*> &s = strips[i];
+        cables.emplace_back(s[STRIP_SHUF], SHUF_OUTPUT_GATE_1, s[STRIP_ENV], ENV_INPUT_GATE_TRIG);
+        cables.emplace_back(s[STRIP_ENV], ENV_OUTPUT_SIGNAL, s[STRIP_PAN], PAN_INPUT_SIGNAL_1);
+        cables.emplace_back(s[STRIP_ENV], ENV_OUTPUT_ENV, s[STRIP_FOLLOW], FOLLOW_INPUT_SIGNAL_1);
+        cables.emplace_back(s[STRIP_FOLLOW], FOLLOW_OUTPUT_SIGNAL_1, s[STRIP_PAN], PAN_INPUT_MOD_1);
+
+        // the clock and the audio come from outside of the strip
+        s[STRIP_SHUF]->inputs[SHUF_INPUT_GATE].setChannels(1);
+        s[STRIP_ENV]->inputs[ENV_INPUT_SIGNAL].setChannels(1);
+        s[STRIP_PAN]->outputs[PAN_OUTPUT_SIGNAL_L_1].setChannels(1);
+        s[STRIP_PAN]->outputs[PAN_OUTPUT_SIGNAL_R_1].setChannels(1);
+        s[STRIP_PAN]->params[PAN_PARAM_ATV_1].setValue(0.5f);
+    }
+
+    // each strip gets its own clock rate and phase, so the gates do not line up
+    std::vector<int> clockPeriods(numStrips), clockPhases(numStrips);
+    std::mt19937 rng(1);
+    for (int i = 0; i < numStrips; ++i) {
+        clockPeriods[i] = (int) (sampleRate / (2.f + 6.f * std::uniform_real_distribution<float>()(rng)));
+        clockPhases[i] = rng() % clockPeriods[i];
+    }
+
+    Module::ProcessArgs args;
+    args.sampleRate = sampleRate;
+    args.sampleTime = 1.f / sampleRate;
+
+    PerfCounters counters;
+    auto begin = std::chrono::steady_clock::now();
+    counters.start();
+    float sink = 0.f;
+    for (long long n = 0; n < numSamples; ++n) {
+        float audio = std::sin(n * 0.05f) * 5.f;
+        for (int i = 0; i < numStrips; ++i) {
+            bool clock = (n + clockPhases[i]) % clockPeriods[i] < clockPeriods[i] / 2;
+            strips[i][STRIP_SHUF]->inputs[SHUF_INPUT_GATE].setVoltage(clock ? 10.f : 0.f);
+            strips[i][STRIP_ENV]->inputs[ENV_INPUT_SIGNAL].setVoltage(audio);
+        }
+        for (Module *module : modules)
+            module->process(args);
+        for (BenchCable &cable : cables)
+            cable.step();
+        sink += strips[n % numStrips][STRIP_PAN]->outputs[PAN_OUTPUT_SIGNAL_L_1].getVoltage();
+    }
+    counters.stop();
+    auto end = std::chrono::steady_clock::now();
+
+    const char *layoutNames[] = {"mixed", "grouped", "shuffled"};
+    const char *moduleNames[NUM_STRIP_MODULES] = {"Shuf", "Env", "Follow", "Pan"};
+    double seconds = std::chrono::duration<double>(end - begin).count();
+    long long cycles = counters.read(PerfCounters::COUNTER_CYCLES);
+    long long instructions = counters.read(PerfCounters::COUNTER_INSTRUCTIONS);
+
+#ifdef COLLIDE_COMPACT_STATE
+    std::printf("state layout     %12s\n", "compact");
+#else
+    std::printf("state layout     %12s\n", "baseline");
+#endif
+    std::printf("layout           %12s\n", layoutNames[layout]);
+    std::printf("modules          %12d\n", numStrips * NUM_STRIP_MODULES);
+    std::printf("samples          %12lld\n", numSamples);
+    // the module structs are private to their files, so report the size of their allocations:
+    // the object itself, and with the params, ports and lights that live in separate vectors
+    for (int m = 0; m < NUM_STRIP_MODULES; ++m) {
+        size_t objectSize = heapSize(strips[0][m]);
+        std::printf("object/%-9s %12zu\n", moduleNames[m], objectSize);
+        std::printf("state/%-10s %12zu\n", moduleNames[m], objectSize + vectorsSize(strips[0][m]));
+    }
+    std::printf("ns/sample        %12.2f\n", seconds * 1e9 / numSamples);
+    std::printf("realtime load    %11.2f%%\n", seconds * sampleRate / numSamples * 100);
+    printPerSample("cycles/sample", cycles, numSamples);
+    printPerSample("L1D miss/sample", counters.read(PerfCounters::COUNTER_L1D_MISSES), numSamples);
+    printPerSample("LLC miss/sample", counters.read(PerfCounters::COUNTER_LLC_MISSES), numSamples);
+    if (cycles > 0 && instructions >= 0)
+        std::printf("IPC              %12.2f\n", (double) instructions / cycles);
+    else
+        std::printf("IPC              %12s\n", "n/a");
+    if (counters.multiplexed)
+        std::fprintf(stderr, "warning: the counters were multiplexed, the counts are scaled estimates\n");
+
+    // keep the outputs alive
+    if (sink == 12345.f)
+        std::printf("\n");
+    return 0;
+}
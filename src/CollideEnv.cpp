@@ -8,6 +8,35 @@ const float MAX_STAGE_TIME = 10.f;
 const float LAMBDA_BASE = MAX_STAGE_TIME / MIN_STAGE_TIME;
 const float EPSILON = 1e-3f; // the threshold for being close enough
 
+const int STAGE_QUANT_STEPS = 4096; // resolution of the stage time range (0, 1) for memoizing the coefficient
+
+float stageTau(float x) {
+    return pow(LAMBDA_BASE, x) * MIN_STAGE_TIME;
+}
+
+/*! Memoize the RC coefficient of one stage, keyed by the quantized stage time and the sample time
+    pow() is only called when the key changes, so static settings and slow CVs reuse the coefficient
+ */
+struct StageCoefficient {
+    int key = -1;
+    float sampleTime = 0.f;
+    float a = 0.f;
+
+    /*! Return the coefficient
+        @x the stage time in (0, 1)
+     */
+    float update(float x, float st) {
+        int k = (int) std::round(x * STAGE_QUANT_STEPS);
+        if (k != key || st != sampleTime) {
+            key = k;
+            sampleTime = st;
+            float tau = stageTau((float) k / STAGE_QUANT_STEPS);
+            a = tau / (tau + st);
+        }
+        return a;
+    }
+};
+
 
 struct CollideEnv : Module {
     enum ParamIds {
@@ -66,8 +95,10 @@ struct CollideEnv : Module {
     bool isActive;
     RCFilter<float> rcf;
 
+    StageCoefficient attackCoef, decayCoef, releaseCoef;
+
     CollideEnv():
-    rcf(pow(LAMBDA_BASE, 0.5) * MIN_STAGE_TIME)
+    rcf(stageTau(0.5))
     {
         config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
 
@@ -90,7 +121,7 @@ struct CollideEnv : Module {
         float inputGate = inputs[INPUT_GATE_TRIG].getVoltage();
         float attack, decay, sustain, release;
         float attackMod, attackAtv, decayMod, decayAtv, sustainMod, sustainAtv, releaseMod, releaseAtv;
-        float Atau, Dtau, Sval, Rtau;
+        float Ax, Dx, Sval, Rx;
         bool boolGate = inputGate >= 1.0;
         float env;
         int mode;
@@ -126,9 +157,9 @@ struct CollideEnv : Module {
         release = params[PARAM_RELEASE].getValue();
 
         Sval = clamp(sustain + sustainMod * sustainAtv, 0.f, 1.f);
-        Atau = pow(LAMBDA_BASE, clamp(attack + attackMod * attackAtv, 0.f, 1.f)) * MIN_STAGE_TIME;
-        Dtau = pow(LAMBDA_BASE, clamp(decay + decayMod * decayAtv, 0.f, 1.f)) * MIN_STAGE_TIME;
-        Rtau = pow(LAMBDA_BASE, clamp(release + releaseMod * releaseAtv, 0.f, 1.f)) * MIN_STAGE_TIME;
+        Ax = clamp(attack + attackMod * attackAtv, 0.f, 1.f);
+        Dx = clamp(decay + decayMod * decayAtv, 0.f, 1.f);
+        Rx = clamp(release + releaseMod * releaseAtv, 0.f, 1.f);
 
 
         if (gateTrigger.process(inputGate)) {
@@ -156,7 +187,7 @@ struct CollideEnv : Module {
         if (isActive) {
             switch (stage) {
                 case STAGE_ATTACK:
-                    rcf.setTau(Atau);
+                    rcf.a = attackCoef.update(Ax, args.sampleTime);
                     env = rcf.process(1.0);
                     if (outputs[OUTPUT_ATTACK_GATE].isConnected()) {
                         outputs[OUTPUT_ATTACK_GATE].setVoltage(10.f);
@@ -170,7 +201,7 @@ struct CollideEnv : Module {
                     }
                     break;
                 case STAGE_DECAY:
-                    rcf.setTau(Dtau);
+                    rcf.a = decayCoef.update(Dx, args.sampleTime);
                     env = rcf.process(Sval);
                     if (outputs[OUTPUT_DECAY_GATE].isConnected()) {
                         outputs[OUTPUT_DECAY_GATE].setVoltage(10.f);
@@ -188,7 +219,7 @@ struct CollideEnv : Module {
                     lights[LIGHT_SUSTAIN].setBrightness(1.f);
                     break;
                 case STAGE_RELEASE:
-                    rcf.setTau(Rtau);
+                    rcf.a = releaseCoef.update(Rx, args.sampleTime);
                     env = rcf.process(0.f);
                     if (outputs[OUTPUT_RELEASE_GATE].isConnected()) {
                         outputs[OUTPUT_RELEASE_GATE].setVoltage(10.f);
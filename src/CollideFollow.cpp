@@ -1,6 +1,61 @@
 #include "plugin.hpp"
 #include "ColliderUtils.h"
 
+// split frequency range in Hz
+const float MIN_SPLIT_FREQ = 20.f;
+const float SPLIT_FREQ_BASE = 1000.f; // MAX_SPLIT_FREQ / MIN_SPLIT_FREQ
+
+/*! Split a signal into 4 bands with Linkwitz-Riley (4th order) crossovers
+    The lanes of the output are the bands, from low to high.
+    The first stage splits every lane at the middle frequency, and the second stage
+    splits the low and the high halves again, so all the bands run in the same float_4.
+ */
+struct LR4Crossover {
+    // a 4th order Linkwitz-Riley filter is two Butterworth filters in series
+    Biquad<simd::float_4> stage1[2];
+    Biquad<simd::float_4> stage2[2];
+
+    /*! Update the coefficients
+        @splits the 3 split frequencies in Hz, from low to high
+     */
+    void setSplits(const float* splits) {
+        float c[4][5];
+        // stage 1: lowpass, lowpass, highpass, highpass at the middle split
+        butterworthCoefficients(splits[1], false, c[0]);
+        butterworthCoefficients(splits[1], true, c[2]);
+        setCoefficients(stage1, c[0], c[0], c[2], c[2]);
+
+        // stage 2: lowpass and highpass at the low split, lowpass and highpass at the high split
+        butterworthCoefficients(splits[0], false, c[0]);
+        butterworthCoefficients(splits[0], true, c[1]);
+        butterworthCoefficients(splits[2], false, c[2]);
+        butterworthCoefficients(splits[2], true, c[3]);
+        setCoefficients(stage2, c[0], c[1], c[2], c[3]);
+    }
+
+    void setCoefficients(Biquad<simd::float_4>* stage, const float* c0, const float* c1, const float* c2, const float* c3) {
+        simd::float_4 c[5];
+        for (int i = 0; i < 5; ++i)
+            c[i] = simd::float_4(c0[i], c1[i], c2[i], c3[i]);
+        for (int i = 0; i < 2; ++i)
+            stage[i].setCoefficients(c[0], c[1], c[2], c[3], c[4]);
+    }
+
+    simd::float_4 process(float xn) {
+        simd::float_4 yn = xn;
+        yn = stage1[1].process(stage1[0].process(yn));
+        yn = stage2[1].process(stage2[0].process(yn));
+        return yn;
+    }
+
+    void reset() {
+        for (int i = 0; i < 2; ++i) {
+            stage1[i].reset();
+            stage2[i].reset();
+        }
+    }
+};
+
 struct CollideFollow : Module {
     enum ParamIds {
         PARAM_SENSI_1,
@@ -21,38 +76,128 @@ struct CollideFollow : Module {
         NUM_LIGHTS
     };
 
+#ifdef COLLIDE_COMPACT_STATE
+    // the compact state layout (bench/) keeps both followers in lanes 0 and 1 of one diode
+    RCDiode<simd::float_4> rcd;
+#else
     RCDiode<float> rcd_1, rcd_2;
+#endif
     float env_1=0.f, env_2=0.f;
 
+    // multiband mode: each output carries the envelopes of 4 bands
+    bool multiband = false;
+    float splits[3] = {200.f, 1000.f, 5000.f};
+    float appliedSplits[3] = {0.f, 0.f, 0.f};
+    float crossoverSampleRate = 0.f;
+    LR4Crossover crossover_1, crossover_2;
+    RCDiode<simd::float_4> rcdBands_1, rcdBands_2;
+
     CollideFollow():
+#ifdef COLLIDE_COMPACT_STATE
+    rcd(0.5*5),
+#else
     rcd_1(0.5*5),
-    rcd_2(0.5*5)
+    rcd_2(0.5*5),
+#endif
+    rcdBands_1(0.5*5),
+    rcdBands_2(0.5*5)
     {
         config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
         configParam(PARAM_SENSI_1, 0.f, 1.f, 0.5f, "Sensitivity 1");
         configParam(PARAM_SENSI_2, 0.f, 1.f, 0.5f, "Sensitivity 2");
     }
 
+    void onReset() override {
+        multiband = false;
+        splits[0] = 200.f;
+        splits[1] = 1000.f;
+        splits[2] = 5000.f;
+    }
+
+    json_t* dataToJson() override {
+        json_t* rootJ = json_object();
+        json_object_set_new(rootJ, "multiband", json_boolean(multiband));
+        json_t* splitsJ = json_array();
+        for (int i=0; i<3; ++i)
+            json_array_append_new(splitsJ, json_real(splits[i]));
+        json_object_set_new(rootJ, "splits", splitsJ);
+        return rootJ;
+    }
+
+    void dataFromJson(json_t* rootJ) override {
+        json_t* multibandJ = json_object_get(rootJ, "multiband");
+        if (multibandJ)
+            multiband = json_boolean_value(multibandJ);
+        json_t* splitsJ = json_object_get(rootJ, "splits");
+        if (splitsJ) {
+            for (int i=0; i<3; ++i) {
+                json_t* splitJ = json_array_get(splitsJ, i);
+                if (splitJ)
+                    splits[i] = clamp((float) json_number_value(splitJ), MIN_SPLIT_FREQ, MIN_SPLIT_FREQ * SPLIT_FREQ_BASE);
+            }
+        }
+    }
+
+    void processMultiband(const ProcessArgs& args, float tau_1, float tau_2) {
+        // the coefficients are only updated when the settings change
+        if (crossoverSampleRate != args.sampleRate || appliedSplits[0] != splits[0]
+            || appliedSplits[1] != splits[1] || appliedSplits[2] != splits[2]) {
+            crossoverSampleRate = args.sampleRate;
+            float sortedSplits[3];
+            for (int i=0; i<3; ++i) {
+                appliedSplits[i] = splits[i];
+                sortedSplits[i] = splits[i];
+            }
+            // the sliders are independent, keep the bands from low to high
+            std::sort(sortedSplits, sortedSplits + 3);
+            crossover_1.setSplits(sortedSplits);
+            crossover_2.setSplits(sortedSplits);
+        }
+
+        rcdBands_1.setTau(tau_1);
+        rcdBands_2.setTau(tau_2);
+
+        simd::float_4 bands_1 = crossover_1.process(inputs[INPUT_SIGNAL_1].getVoltage());
+        simd::float_4 bands_2 = crossover_2.process(inputs[INPUT_SIGNAL_2].getVoltage());
+        simd::float_4 envBands_1 = rcdBands_1.chargeOrDecay(simd::fabs(bands_1));
+        simd::float_4 envBands_2 = rcdBands_2.chargeOrDecay(simd::fabs(bands_2));
+
+        outputs[OUTPUT_SIGNAL_1].setChannels(4);
+        outputs[OUTPUT_SIGNAL_2].setChannels(4);
+        if (outputs[OUTPUT_SIGNAL_1].isConnected())
+            outputs[OUTPUT_SIGNAL_1].setVoltageSimd(envBands_1, 0);
+
+        if (outputs[OUTPUT_SIGNAL_2].isConnected())
+            outputs[OUTPUT_SIGNAL_2].setVoltageSimd(envBands_2, 0);
+    }
+
     void process(const ProcessArgs& args) override {
         float tau_1 = clamp((1 - params[PARAM_SENSI_1].getValue()) * 5, 0.01, 5.0);
         float tau_2 = clamp((1 - params[PARAM_SENSI_2].getValue()) * 5, 0.01, 5.0);
 
+        if (multiband) {
+            processMultiband(args, tau_1, tau_2);
+            return;
+        }
+
         float rect_in_1 = std::abs(inputs[INPUT_SIGNAL_1].getVoltage());
         float rect_in_2 = std::abs(inputs[INPUT_SIGNAL_2].getVoltage());
 
+#ifdef COLLIDE_COMPACT_STATE
+        rcd.setTau(simd::float_4(tau_1, tau_2, tau_2, tau_2));
+        simd::float_4 env = rcd.chargeOrDecay(simd::float_4(rect_in_1, rect_in_2, 0.f, 0.f));
+        env_1 = env[0];
+        env_2 = env[1];
+#else
         rcd_1.setTau(tau_1);
         rcd_2.setTau(tau_2);
 
-        if (rect_in_1 > env_1)
-            env_1 = rcd_1.charge(rect_in_1);
-        else
-            env_1 = rcd_1.process(rect_in_1);
-
-        if (rect_in_2 > env_2)
-            env_2 = rcd_2.charge(rect_in_2);
-        else
-            env_2 = rcd_2.process(rect_in_2);
+        env_1 = rcd_1.chargeOrDecay(rect_in_1);
+        env_2 = rcd_2.chargeOrDecay(rect_in_2);
+#endif
 
+        outputs[OUTPUT_SIGNAL_1].setChannels(1);
+        outputs[OUTPUT_SIGNAL_2].setChannels(1);
         if (outputs[OUTPUT_SIGNAL_1].isConnected())
             outputs[OUTPUT_SIGNAL_1].setVoltage(env_1);
 
@@ -62,6 +207,68 @@ struct CollideFollow : Module {
 };
 
 
+struct MultibandItem : MenuItem {
+    CollideFollow* module;
+
+    void onAction(const event::Action& e) override {
+        module->multiband ^= true;
+    }
+};
+
+struct SplitQuantity : Quantity {
+    CollideFollow* module;
+    int index;
+
+    SplitQuantity(CollideFollow* module, int index): module(module), index(index) {}
+
+    // the value is normalized, the display value is in Hz
+    void setValue(float value) override {
+        value = clamp(value, 0.f, 1.f);
+        module->splits[index] = MIN_SPLIT_FREQ * std::pow(SPLIT_FREQ_BASE, value);
+    }
+
+    float getValue() override {
+        return std::log(module->splits[index] / MIN_SPLIT_FREQ) / std::log(SPLIT_FREQ_BASE);
+    }
+
+    float getDefaultValue() override {
+        const float defaultSplits[3] = {200.f, 1000.f, 5000.f};
+        return std::log(defaultSplits[index] / MIN_SPLIT_FREQ) / std::log(SPLIT_FREQ_BASE);
+    }
+
+    float getDisplayValue() override {
+        return module->splits[index];
+    }
+
+    void setDisplayValue(float displayValue) override {
+        setValue(std::log(displayValue / MIN_SPLIT_FREQ) / std::log(SPLIT_FREQ_BASE));
+    }
+
+    int getDisplayPrecision() override {
+        return 4;
+    }
+
+    std::string getLabel() override {
+        return string::f("Split %d", index + 1);
+    }
+
+    std::string getUnit() override {
+        return " Hz";
+    }
+};
+
+struct SplitSlider : ui::Slider {
+    SplitSlider(CollideFollow* module, int index) {
+        quantity = new SplitQuantity(module, index);
+        box.size.x = 200.f;
+    }
+
+    ~SplitSlider() {
+        delete quantity;
+    }
+};
+
+
 struct CollideFollowWidget : ModuleWidget {
     CollideFollowWidget(CollideFollow* module) {
         setModule(module);
@@ -82,6 +289,20 @@ struct CollideFollowWidget : ModuleWidget {
         addInput(createInputCentered<PJ301MPort>(Vec(25.8, 308.1), module, CollideFollow::INPUT_SIGNAL_2));
         addOutput(createOutputCentered<PJ301MPort>(Vec(64.2, 308.1), module, CollideFollow::OUTPUT_SIGNAL_2));
     }
+
+    void appendContextMenu(Menu* menu) override {
+        CollideFollow* module = dynamic_cast<CollideFollow*>(this->module);
+        if (!module)
+            return;
+
+        menu->addChild(new MenuSeparator);
+        MultibandItem* multibandItem = createMenuItem<MultibandItem>("Multiband (4 channel outputs)", CHECKMARK(module->multiband));
+        multibandItem->module = module;
+        menu->addChild(multibandItem);
+
+        for (int i=0; i<3; ++i)
+            menu->addChild(new SplitSlider(module, i));
+    }
 };
 
 
@@ -1,5 +1,89 @@
 #include "plugin.hpp"
+#include "ColliderUtils.h"
 
+// binaural mode
+const int DELAY_SIZE = 1024; // must be a power of 2, the interaural delay is up to 504 samples at 768 kHz
+const int CONTROL_INTERVAL = 32; // the delays and the filters are updated every CONTROL_INTERVAL samples
+const float HEAD_RADIUS = 0.0875f; // in m
+const float SOUND_SPEED = 343.f; // in m/s
+const float SHADOW_ALPHA_MIN = 0.1f; // the head shadow gain at high frequencies for the far ear
+const float SHADOW_THETA_MIN = 150.f / 180.f * M_PI; // where the shadow is the strongest
+
+/*! A spherical head model (Brown and Duda) for 2 sources
+    The lanes are {left 1, right 1, left 2, right 2}. Each ear gets the interaural time difference
+    through a fractional delay, and the head shadow through a one-pole one-zero filter.
+    The ears are scaled by sqrt(1/2), so a centered source has the level of the equal power mode.
+ */
+struct BinauralPanner {
+    simd::float_4 buffer[DELAY_SIZE];
+    int writePos = 0;
+    simd::float_4 delay = 0.f; // in samples
+    simd::float_4 delayStep = 0.f; // how much the delay moves every sample
+    Biquad<simd::float_4> shadow;
+
+    BinauralPanner() {
+        reset();
+    }
+
+    /*! Update the targets of the delays and the head shadow filters
+        @azimuths the azimuths of the 2 sources, from -pi/2 (left) to pi/2 (right)
+     */
+    void setAzimuths(const float* azimuths, float sampleRate) {
+        const float earAzimuths[2] = {-M_PI / 2, M_PI / 2};
+        // bilinear transform of H(s) = (1 + alpha * s / (2 * w0)) / (1 + s / (2 * w0)), w0 = c / r
+        const float TK = 2.f * sampleRate * HEAD_RADIUS / (2.f * SOUND_SPEED);
+        simd::float_4 targetDelay, b0, b1, a1;
+
+        for (int i = 0; i < 2; ++i) {
+            float ear[2];
+            for (int j = 0; j < 2; ++j) {
+                // the angle between the ear and the source, from 0 to pi
+                float theta = std::abs(azimuths[i] - earAzimuths[j]);
+
+                if (theta < M_PI / 2)
+                    ear[j] = HEAD_RADIUS / SOUND_SPEED * (1 - std::cos(theta));
+                else
+                    ear[j] = HEAD_RADIUS / SOUND_SPEED * (1 + theta - M_PI / 2);
+
+                float alpha = (1 + SHADOW_ALPHA_MIN / 2) + (1 - SHADOW_ALPHA_MIN / 2) * std::cos(theta / SHADOW_THETA_MIN * M_PI);
+                b0[2 * i + j] = (1 + alpha * TK) / (1 + TK);
+                b1[2 * i + j] = (1 - alpha * TK) / (1 + TK);
+                a1[2 * i + j] = (1 - TK) / (1 + TK);
+            }
+
+            // only delay the far ear
+            float nearest = std::min(ear[0], ear[1]);
+            for (int j = 0; j < 2; ++j)
+                targetDelay[2 * i + j] = clamp((ear[j] - nearest) * sampleRate, 0.f, DELAY_SIZE - 2.f);
+        }
+
+        delayStep = (targetDelay - delay) / CONTROL_INTERVAL;
+        shadow.setCoefficients(b0, b1, 0.f, a1, 0.f);
+    }
+
+    simd::float_4 process(simd::float_4 xn) {
+        buffer[writePos] = xn;
+        delay += delayStep;
+
+        // linear interpolation between the 2 samples around the delay of each lane
+        simd::float_4 y0, y1, frac;
+        for (int i = 0; i < 4; ++i) {
+            int d = (int) delay[i];
+            frac[i] = delay[i] - d;
+            y0[i] = buffer[(writePos - d) & (DELAY_SIZE - 1)][i];
+            y1[i] = buffer[(writePos - d - 1) & (DELAY_SIZE - 1)][i];
+        }
+        writePos = (writePos + 1) & (DELAY_SIZE - 1);
+
+        return shadow.process(y0 + frac * (y1 - y0)) * (float) M_SQRT1_2;
+    }
+
+    void reset() {
+        for (int i = 0; i < DELAY_SIZE; ++i)
+            buffer[i] = 0.f;
+        shadow.reset();
+    }
+};
 
 struct CollidePan : Module {
 	enum ParamIds {
@@ -27,16 +111,30 @@ struct CollidePan : Module {
 		NUM_LIGHTS
 	};
 
+#ifdef COLLIDE_COMPACT_STATE
+    // the compact state layout (bench/) shares the index tables between the instances
+    static constexpr int outIdxL[2] = {OUTPUT_SIGNAL_L_1, OUTPUT_SIGNAL_L_2};
+    static constexpr int outIdxR[2] = {OUTPUT_SIGNAL_R_1, OUTPUT_SIGNAL_R_2};
+    static constexpr int panIdx[2] = {PARAM_PAN_1, PARAM_PAN_2};
+    static constexpr int atvIdx[2] = {PARAM_ATV_1, PARAM_ATV_2};
+    static constexpr int modIdx[2] = {INPUT_MOD_1, INPUT_MOD_2};
+    static constexpr int inIdx[2] = {INPUT_SIGNAL_1, INPUT_SIGNAL_2};
+#else
     const int outIdxL[2] = {OUTPUT_SIGNAL_L_1, OUTPUT_SIGNAL_L_2};
     const int outIdxR[2] = {OUTPUT_SIGNAL_R_1, OUTPUT_SIGNAL_R_2};
     const int panIdx[2] = {PARAM_PAN_1, PARAM_PAN_2};
     const int atvIdx[2] = {PARAM_ATV_1, PARAM_ATV_2};
     const int modIdx[2] = {INPUT_MOD_1, INPUT_MOD_2};
     const int inIdx[2] = {INPUT_SIGNAL_1, INPUT_SIGNAL_2};
+#endif
 
     float pan[2] = {0.5, 0.5};
     float atv[2] = {0, 0};
 
+    bool binaural = false;
+    int controlPhase = 0;
+    BinauralPanner binauralPanner;
+
 	CollidePan() {
 		config(NUM_PARAMS, NUM_INPUTS, NUM_OUTPUTS, NUM_LIGHTS);
 		configParam(PARAM_PAN_1, -1.f, 1.f, 0.0f, "Pan 1");
@@ -45,29 +143,85 @@ struct CollidePan : Module {
         configParam(PARAM_ATV_2, -1.f, 1.f, 0.f, "Attenuverter 2");
 	}
 
+    void onReset() override {
+        binaural = false;
+    }
+
+    json_t* dataToJson() override {
+        json_t* rootJ = json_object();
+        json_object_set_new(rootJ, "binaural", json_boolean(binaural));
+        return rootJ;
+    }
+
+    void dataFromJson(json_t* rootJ) override {
+        json_t* binauralJ = json_object_get(rootJ, "binaural");
+        if (binauralJ)
+            binaural = json_boolean_value(binauralJ);
+    }
+
+    /*! Update pan[i] from the knob and the modulation, scaled to (0, 1)
+     */
+    void updatePan(int i) {
+        float mod = 0.f;
+        pan[i] = params[panIdx[i]].getValue();
+        atv[i] = params[atvIdx[i]].getValue();
+
+        // get pan modulation value
+        if (inputs[modIdx[i]].isConnected()) {
+            mod = inputs[modIdx[i]].getVoltage();
+            mod = clamp(mod, -5.f, 5.f); // trim the value
+            mod /= 5;
+        }
+        mod = mod * atv[i]; // range: (-1, 1)
+
+        pan[i] = pan[i] + mod; // modulate the pan
+        pan[i] = clamp(pan[i], -1.f, 1.f); // trim the value
+        pan[i] = (pan[i] + 1) / 2; // scale it to (0, 1)
+    }
+
+    void processBinaural(const ProcessArgs& args) {
+        // update the head model at control rate
+        if (controlPhase == 0) {
+            float azimuths[2];
+            for (int i=0; i<2; ++i) {
+                updatePan(i);
+                azimuths[i] = (pan[i] * 2 - 1) * M_PI / 2;
+            }
+            binauralPanner.setAzimuths(azimuths, args.sampleRate);
+        }
+        controlPhase = (controlPhase + 1) % CONTROL_INTERVAL;
+
+        float in[2] = {0, 0};
+        for (int i=0; i<2; ++i) {
+            if (inputs[inIdx[i]].isConnected())
+                in[i] = inputs[inIdx[i]].getVoltage();
+        }
+        simd::float_4 out = binauralPanner.process(simd::float_4(in[0], in[0], in[1], in[1]));
+
+        for (int i=0; i<2; ++i) {
+            if (inputs[inIdx[i]].isConnected()) {
+                outputs[outIdxL[i]].setVoltage(out[2 * i]);
+                outputs[outIdxR[i]].setVoltage(out[2 * i + 1]);
+            } else {
+                outputs[outIdxL[i]].setVoltage(0.f);
+                outputs[outIdxR[i]].setVoltage(0.f);
+            }
+        }
+    }
+
 	void process(const ProcessArgs& args) override {
+	    if (binaural) {
+	        processBinaural(args);
+	        return;
+	    }
 
 	    float out[2] = {0, 0};
-	    float mod[2] = {0, 0};
 
 	    for (int i=0; i<2; ++i) {
 	        // if pan[i] and atv[i] don't change, don't update mod
 	        if (inputs[inIdx[i]].isConnected()) {
 	            out[i] = inputs[inIdx[i]].getVoltage();
-                pan[i] = params[panIdx[i]].getValue();
-                atv[i] = params[atvIdx[i]].getValue();
-
-                // get pan modulation value
-                if (inputs[modIdx[i]].isConnected()) {
-                    mod[i] = inputs[modIdx[i]].getVoltage();
-                    mod[i] = clamp(mod[i], -5.f, 5.f); // trim the value
-                    mod[i] /= 5;
-                }
-                mod[i] = mod[i] * atv[i]; // range: (-1, 1)
-
-                pan[i] = pan[i] + mod[i]; // modulate the pan
-                pan[i] = clamp(pan[i], -1.f, 1.f); // trim the value
-                pan[i] = (pan[i] + 1) / 2; // scale it to (0, 1)
+                updatePan(i);
 
                 // equal power panning
                 if (outputs[outIdxL[i]].isConnected()) {
@@ -85,6 +239,25 @@ struct CollidePan : Module {
 };
 
 
+#ifdef COLLIDE_COMPACT_STATE
+constexpr int CollidePan::outIdxL[2];
+constexpr int CollidePan::outIdxR[2];
+constexpr int CollidePan::panIdx[2];
+constexpr int CollidePan::atvIdx[2];
+constexpr int CollidePan::modIdx[2];
+constexpr int CollidePan::inIdx[2];
+#endif
+
+
+struct BinauralItem : MenuItem {
+    CollidePan* module;
+
+    void onAction(const event::Action& e) override {
+        module->binaural ^= true;
+    }
+};
+
+
 struct CollidePanWidget : ModuleWidget {
 	CollidePanWidget(CollidePan* module) {
 		setModule(module);
@@ -116,6 +289,17 @@ struct CollidePanWidget : ModuleWidget {
         addOutput(createOutputCentered<PJ301MPort>(Vec(25.8, 324.5), module, CollidePan::OUTPUT_SIGNAL_L_2));
         addOutput(createOutputCentered<PJ301MPort>(Vec(64.2, 324.5), module, CollidePan::OUTPUT_SIGNAL_R_2));
 	}
+
+    void appendContextMenu(Menu* menu) override {
+        CollidePan* module = dynamic_cast<CollidePan*>(this->module);
+        if (!module)
+            return;
+
+        menu->addChild(new MenuSeparator);
+        BinauralItem* binauralItem = createMenuItem<BinauralItem>("Binaural (headphones)", CHECKMARK(module->binaural));
+        binauralItem->module = module;
+        menu->addChild(binauralItem);
+    }
 };
 
 
@@ -5,9 +5,27 @@
 #ifndef COLLIDE_COLLIDERUTILS_H
 #define COLLIDE_COLLIDERUTILS_H
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+/*! Select a where mask is true and b elsewhere, without branching
+    T can be float or simd::float_4, mask is the result of a comparison between two T
+ */
+inline float rcSelect(bool mask, float a, float b) {
+    return mask ? a : b;
+}
+
+inline simd::float_4 rcSelect(simd::float_4 mask, simd::float_4 a, simd::float_4 b) {
+    return simd::ifelse(mask, a, b);
+}
+
+/*! A one pole lowpass filter
+    T can be float, or simd::float_4 to run 4 independent filters
+ */
 template <typename T>
 struct RCFilter {
-    T yn1;
+    T yn1 = 0.f;
     T a; // the filter coefficient
 
     RCFilter(T tau) {
@@ -31,6 +49,21 @@ struct RCFilter {
         return yn;
     }
 
+    /*! Process n values, keeping the state in registers
+        @xn the target values
+        @yn the output values, can be the same buffer as xn
+     */
+    void processBlock(const T* xn, T* yn, int n) {
+        T y = yn1;
+        T a = this->a;
+        T b = 1 - a;
+        for (int i = 0; i < n; ++i) {
+            y = a * y + b * xn[i];
+            yn[i] = y;
+        }
+        yn1 = y;
+    }
+
     void reset(T rstVal = 0.f) {
         yn1 = rstVal;
     }
@@ -46,6 +79,149 @@ struct RCDiode: RCFilter<T> {
         this->yn1 = vi;
         return vi;
     }
+
+    /*! Charge if vi is above the current value, otherwise decay to vi
+        The lanes of a simd::float_4 are selected independently
+     */
+    T chargeOrDecay(T vi) {
+        T yn = rcSelect(vi > this->yn1, vi, this->a * this->yn1 + (1 - this->a) * vi);
+        this->yn1 = yn;
+        return yn;
+    }
+
+    /*! chargeOrDecay() n values, keeping the state in registers
+        @vi the input values
+        @yn the output values, can be the same buffer as vi
+     */
+    void chargeOrDecayBlock(const T* vi, T* yn, int n) {
+        T y = this->yn1;
+        T a = this->a;
+        T b = 1 - a;
+        for (int i = 0; i < n; ++i) {
+            y = rcSelect(vi[i] > y, vi[i], a * y + b * vi[i]);
+            yn[i] = y;
+        }
+        this->yn1 = y;
+    }
+};
+
+/*! A transposed direct form II biquad filter
+    T can be float, or simd::float_4 to run 4 filters with their own coefficients
+ */
+template <typename T>
+struct Biquad {
+    T b0 = 1.f, b1 = 0.f, b2 = 0.f, a1 = 0.f, a2 = 0.f;
+    T z1 = 0.f, z2 = 0.f;
+
+    void setCoefficients(T b0, T b1, T b2, T a1, T a2) {
+        this->b0 = b0;
+        this->b1 = b1;
+        this->b2 = b2;
+        this->a1 = a1;
+        this->a2 = a2;
+    }
+
+    T process(T xn) {
+        T yn = b0 * xn + z1;
+        z1 = b1 * xn - a1 * yn + z2;
+        z2 = b2 * xn - a2 * yn;
+        return yn;
+    }
+
+    void reset() {
+        z1 = 0.f;
+        z2 = 0.f;
+    }
+};
+
+/*! Compute the coefficients {b0, b1, b2, a1, a2} of a second order Butterworth filter
+    @fc the cutoff frequency, in Hz
+    @highpass true for a highpass, false for a lowpass
+ */
+inline void butterworthCoefficients(float fc, bool highpass, float* coeffs) {
+    float sampleRate = APP->engine->getSampleRate();
+    fc = clamp(fc, 1.f, 0.45f * sampleRate);
+    float w0 = 2.f * M_PI * fc / sampleRate;
+    float cosw0 = std::cos(w0);
+    float alpha = std::sin(w0) / (2.f * M_SQRT1_2);
+    float a0 = 1.f + alpha;
+
+    float b1 = highpass ? -(1.f + cosw0) : 1.f - cosw0;
+    coeffs[0] = std::abs(b1) / 2.f / a0;
+    coeffs[1] = b1 / a0;
+    coeffs[2] = coeffs[0];
+    coeffs[3] = -2.f * cosw0 / a0;
+    coeffs[4] = (1.f - alpha) / a0;
+}
+
+/*! GROUPS * 4 independent RC diodes, e.g. one per polyphony channel
+    The blocks are interleaved: frame i of channel c is at [i * GROUPS * 4 + c].
+    The recurrences of all channels are computed together, so the latency of one
+    recurrence is hidden by the others. With AVX, two groups share one register.
+ */
+template <int GROUPS>
+struct RCDiodeBank {
+    simd::float_4 yn1[GROUPS];
+    simd::float_4 a[GROUPS];
+
+    RCDiodeBank(float tau) {
+        for (int g = 0; g < GROUPS; ++g) {
+            yn1[g] = 0.f;
+            setTau(g, tau);
+        }
+    }
+
+    void setTau(int g, simd::float_4 tau) {
+        a[g] = tau / (tau + APP->engine->getSampleTime());
+    }
+
+    void chargeOrDecayBlock(const float* vi, float* yn, int n) {
+        const int stride = GROUPS * 4;
+#if defined(__AVX__)
+        const int PAIRS = GROUPS / 2;
+#else
+        const int PAIRS = 0;
+#endif
+        // the first 2 * PAIRS groups run in pairs, the others in float_4,
+        // and every sample steps all of them so their recurrences interleave
+        simd::float_4 y[GROUPS], b[GROUPS];
+        for (int k = 2 * PAIRS; k < GROUPS; ++k) {
+            y[k] = yn1[k];
+            b[k] = 1 - a[k];
+        }
+#if defined(__AVX__)
+        __m256 y8[PAIRS + 1], a8[PAIRS + 1], b8[PAIRS + 1];
+        for (int p = 0; p < PAIRS; ++p) {
+            y8[p] = _mm256_set_m128(yn1[2 * p + 1].v, yn1[2 * p].v);
+            a8[p] = _mm256_set_m128(a[2 * p + 1].v, a[2 * p].v);
+            b8[p] = _mm256_sub_ps(_mm256_set1_ps(1.f), a8[p]);
+        }
+#endif
+        for (int i = 0; i < n; ++i) {
+#if defined(__AVX__)
+            for (int p = 0; p < PAIRS; ++p) {
+                __m256 x = _mm256_loadu_ps(&vi[i * stride + p * 8]);
+                __m256 decay = _mm256_add_ps(_mm256_mul_ps(a8[p], y8[p]), _mm256_mul_ps(b8[p], x));
+                __m256 mask = _mm256_cmp_ps(x, y8[p], _CMP_GT_OQ);
+                y8[p] = _mm256_or_ps(_mm256_and_ps(mask, x), _mm256_andnot_ps(mask, decay));
+                _mm256_storeu_ps(&yn[i * stride + p * 8], y8[p]);
+            }
+#endif
+            for (int k = 2 * PAIRS; k < GROUPS; ++k) {
+                simd::float_4 x = simd::float_4::load(&vi[i * stride + k * 4]);
+                y[k] = rcSelect(x > y[k], x, a[k] * y[k] + b[k] * x);
+                y[k].store(&yn[i * stride + k * 4]);
+            }
+        }
+#if defined(__AVX__)
+        for (int p = 0; p < PAIRS; ++p) {
+            yn1[2 * p] = _mm256_castps256_ps128(y8[p]);
+            yn1[2 * p + 1] = _mm256_extractf128_ps(y8[p], 1);
+        }
+#endif
+        for (int k = 2 * PAIRS; k < GROUPS; ++k)
+            yn1[k] = y[k];
+    }
 };
 
 #endif //COLLIDE_COLLIDERUTILS_H